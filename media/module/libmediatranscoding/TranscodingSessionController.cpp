@@ -17,15 +17,22 @@
 //#define LOG_NDEBUG 0
 #define LOG_TAG "TranscodingSessionController"
 
+// Validate controller invariants after every state change in debug builds.
+// The validation walks every queue and session, which is too costly to leave
+// on in production.
+#ifndef NDEBUG
 #define VALIDATE_STATE 1
+#endif
 
 #include <android/permission_manager.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <media/TranscodingSessionController.h>
 #include <media/TranscodingUidPolicy.h>
 #include <utils/AndroidThreads.h>
 #include <utils/Log.h>
 
+#include <algorithm>
 #include <thread>
 #include <utility>
 
@@ -35,11 +42,30 @@ static_assert((SessionIdType)-1 < 0, "SessionIdType should be signed");
 
 constexpr static uid_t OFFLINE_UID = -1;
 constexpr static size_t kSessionHistoryMax = 100;
+constexpr static size_t kSessionNodePoolMax = 16;
 
 //static
-String8 TranscodingSessionController::sessionToString(const SessionKeyType& sessionKey) {
-    return String8::format("{client:%lld, session:%d}", (long long)sessionKey.first,
-                           sessionKey.second);
+TranscodingSessionController::SessionKeyString TranscodingSessionController::sessionToString(
+        const SessionKeyType& sessionKey) {
+    SessionKeyString str;
+    snprintf(str.buffer, sizeof(str.buffer), "{client:%lld, session:%d}",
+             (long long)sessionKey.first, sessionKey.second);
+    return str;
+}
+
+// Formats directly onto the end of a (pre-reserved) dump string, so dumping
+// doesn't bounce every line through a String8 reallocation.
+__attribute__((format(printf, 2, 3))) static void appendFormat(std::string& result,
+                                                               const char* format, ...) {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buffer, SIZE, format, ap);
+    va_end(ap);
+    if (len > 0) {
+        result.append(buffer, std::min((size_t)len, SIZE - 1));
+    }
 }
 
 //static
@@ -336,11 +362,17 @@ TranscodingSessionController::TranscodingSessionController(
         mResourcePolicy(resourcePolicy),
         mThermalPolicy(thermalPolicy),
         mCurrentSession(nullptr),
+        mCachedTopUid(OFFLINE_UID),
+        mCachedTopSession(nullptr),
+        mTopSessionDirty(true),
         mResourceLost(false) {
     // Only push empty offline queue initially. Realtime queues are added when requests come in.
-    mUidSortedList.push_back(OFFLINE_UID);
-    mOfflineUidIterator = mUidSortedList.begin();
-    mSessionQueues.emplace(OFFLINE_UID, SessionQueueType());
+    // The offline queue always stays at the end of mUidQueues.
+    mUidQueues.reserve(16);
+    mUidQueues.push_back({OFFLINE_UID, SessionQueueType()});
+    // Size the session map for a typical burst up front so the first wave of
+    // submits doesn't trigger incremental rehashing.
+    mSessionMap.reserve(64);
     mUidPackageNames[OFFLINE_UID] = "(offline)";
     mThermalThrottling = thermalPolicy->getThrottlingStatus();
     if (config != nullptr) {
@@ -354,74 +386,62 @@ TranscodingSessionController::TranscodingSessionController(
 
 TranscodingSessionController::~TranscodingSessionController() {}
 
-void TranscodingSessionController::dumpSession_l(const Session& session, String8& result,
+void TranscodingSessionController::dumpSession_l(const Session& session, std::string& result,
                                                  bool closedSession) {
-    const size_t SIZE = 256;
-    char buffer[SIZE];
     const TranscodingRequestParcel& request = session.request;
-    snprintf(buffer, SIZE, "      Session: %s, %s, %d%%\n", sessionToString(session.key).c_str(),
-             sessionStateToString(session.getState()), session.lastProgress);
-    result.append(buffer);
-    snprintf(buffer, SIZE, "        pkg: %s\n", request.clientPackageName.c_str());
-    result.append(buffer);
-    snprintf(buffer, SIZE, "        src: %s\n", request.sourceFilePath.c_str());
-    result.append(buffer);
-    snprintf(buffer, SIZE, "        dst: %s\n", request.destinationFilePath.c_str());
-    result.append(buffer);
+    appendFormat(result, "      Session: %s, %s, %d%%\n", sessionToString(session.key).c_str(),
+                 sessionStateToString(session.getState()), session.lastProgress);
+    appendFormat(result, "        pkg: %s\n", request.clientPackageName.c_str());
+    appendFormat(result, "        src: %s\n", request.sourceFilePath.c_str());
+    appendFormat(result, "        dst: %s\n", request.destinationFilePath.c_str());
 
     if (closedSession) {
-        snprintf(buffer, SIZE,
-                 "        waiting: %.1fs, running: %.1fs, paused: %.1fs, paused count: %d\n",
-                 session.waitingTime.count() / 1000000.0f, session.runningTime.count() / 1000000.0f,
-                 session.pausedTime.count() / 1000000.0f, session.pauseCount);
-        result.append(buffer);
+        appendFormat(result,
+                     "        waiting: %.1fs, running: %.1fs, paused: %.1fs, paused count: %d\n",
+                     session.waitingTime.count() / 1000000.0f,
+                     session.runningTime.count() / 1000000.0f,
+                     session.pausedTime.count() / 1000000.0f, session.pauseCount);
     }
 }
 
 void TranscodingSessionController::dumpAllSessions(int fd, const Vector<String16>& args __unused) {
-    String8 result;
+    std::string result;
 
-    const size_t SIZE = 256;
-    char buffer[SIZE];
     std::scoped_lock lock{mLock};
 
-    snprintf(buffer, SIZE, "\n========== Dumping live sessions queues =========\n");
-    result.append(buffer);
-    snprintf(buffer, SIZE, "  Total num of Sessions: %zu\n", mSessionMap.size());
-    result.append(buffer);
-
-    std::vector<int32_t> uids(mUidSortedList.begin(), mUidSortedList.end());
+    // ~5 lines of up to 256B per session, plus headers.
+    result.reserve((mSessionMap.size() + mSessionHistory.size()) * 5 * 256 + 1024);
 
-    for (int32_t i = 0; i < uids.size(); i++) {
-        const uid_t uid = uids[i];
+    appendFormat(result, "\n========== Dumping live sessions queues =========\n");
+    appendFormat(result, "  Total num of Sessions: %zu\n", mSessionMap.size());
 
-        if (mSessionQueues[uid].empty()) {
+    // Single pass in scheduling order; uids with nothing queued are skipped
+    // before any of their info is fetched.
+    for (const UidQueue& uidQueue : mUidQueues) {
+        if (uidQueue.queue.empty()) {
             continue;
         }
-        snprintf(buffer, SIZE, "    uid: %d, pkg: %s\n", uid,
-                 mUidPackageNames.count(uid) > 0 ? mUidPackageNames[uid].c_str() : "(unknown)");
-        result.append(buffer);
-        snprintf(buffer, SIZE, "      Num of sessions: %zu\n", mSessionQueues[uid].size());
-        result.append(buffer);
-        for (auto& sessionKey : mSessionQueues[uid]) {
+        auto nameIt = mUidPackageNames.find(uidQueue.uid);
+        appendFormat(result, "    uid: %d, pkg: %s\n", uidQueue.uid,
+                     nameIt != mUidPackageNames.end() ? nameIt->second.c_str() : "(unknown)");
+        appendFormat(result, "      Num of sessions: %zu\n", uidQueue.queue.size());
+        for (auto& sessionKey : uidQueue.queue) {
             auto sessionIt = mSessionMap.find(sessionKey);
             if (sessionIt == mSessionMap.end()) {
-                snprintf(buffer, SIZE, "Failed to look up Session %s  \n",
-                         sessionToString(sessionKey).c_str());
-                result.append(buffer);
+                appendFormat(result, "Failed to look up Session %s  \n",
+                             sessionToString(sessionKey).c_str());
                 continue;
             }
             dumpSession_l(sessionIt->second, result);
         }
     }
 
-    snprintf(buffer, SIZE, "\n========== Dumping past sessions =========\n");
-    result.append(buffer);
+    appendFormat(result, "\n========== Dumping past sessions =========\n");
     for (auto& session : mSessionHistory) {
         dumpSession_l(session, result, true /*closedSession*/);
     }
 
-    write(fd, result.c_str(), result.size());
+    write(fd, result.data(), result.size());
 }
 
 /*
@@ -439,17 +459,23 @@ TranscodingSessionController::Session* TranscodingSessionController::getTopSessi
         return nullptr;
     }
 
-    uid_t topUid = *mUidSortedList.begin();
+    // The top uid and the front of its queue only change when the queues or the
+    // uid order are mutated; those paths set mTopSessionDirty.
+    if (mTopSessionDirty) {
+        const UidQueue& topQueue = mUidQueues.front();
+        mCachedTopUid = topQueue.uid;
+        mCachedTopSession = &mSessionMap.find(topQueue.queue.front())->second;
+        mTopSessionDirty = false;
+    }
     // If the current session is running, and it's in the topUid's queue, let it continue
     // to run even if it's not the earliest in that uid's queue.
     // For example, uid(B) is added to a session while it's pending in uid(A)'s queue, then
     // B is brought to front which caused the session to run, then user switches back to A.
     if (mCurrentSession != nullptr && mCurrentSession->getState() == Session::RUNNING &&
-        mCurrentSession->allClientUids.count(topUid) > 0) {
+        mCurrentSession->allClientUids.count(mCachedTopUid) > 0) {
         return mCurrentSession;
     }
-    SessionKeyType topSessionKey = *mSessionQueues[topUid].begin();
-    return &mSessionMap[topSessionKey];
+    return mCachedTopSession;
 }
 
 void TranscodingSessionController::setSessionState_l(Session* session, Session::State state) {
@@ -547,7 +573,7 @@ void TranscodingSessionController::updateCurrentSession_l() {
                 // Unfortunately all uids requesting this session are out of quota.
                 // Drop this session and try the next one.
                 {
-                    auto clientCallback = mSessionMap[topSession->key].callback.lock();
+                    auto clientCallback = topSession->callback.lock();
                     if (clientCallback != nullptr) {
                         clientCallback->onTranscodingFailed(
                                 topSession->key.second, TranscodingErrorCode::kDroppedByService);
@@ -569,30 +595,42 @@ void TranscodingSessionController::updateCurrentSession_l() {
     mCurrentSession = topSession;
 }
 
+size_t TranscodingSessionController::findUidQueueIndex_l(uid_t uid) const {
+    size_t index = 0;
+    while (index < mUidQueues.size() && mUidQueues[index].uid != uid) {
+        index++;
+    }
+    return index;
+}
+
 void TranscodingSessionController::addUidToSession_l(uid_t clientUid,
                                                      const SessionKeyType& sessionKey) {
     // If it's an offline session, the queue was already added in constructor.
     // If it's a real-time sessions, check if a queue is already present for the uid,
     // and add a new queue if needed.
+    size_t index = findUidQueueIndex_l(clientUid);
     if (clientUid != OFFLINE_UID) {
-        if (mSessionQueues.count(clientUid) == 0) {
+        if (index == mUidQueues.size()) {
             mUidPolicy->registerMonitorUid(clientUid);
             if (mUidPolicy->isUidOnTop(clientUid)) {
-                mUidSortedList.push_front(clientUid);
+                index = 0;
             } else {
                 // Shouldn't be submitting real-time requests from non-top app,
-                // put it in front of the offline queue.
-                mUidSortedList.insert(mOfflineUidIterator, clientUid);
-            }
-        } else if (clientUid != *mUidSortedList.begin()) {
-            if (mUidPolicy->isUidOnTop(clientUid)) {
-                mUidSortedList.remove(clientUid);
-                mUidSortedList.push_front(clientUid);
+                // put it in front of the offline queue (the last entry).
+                index = mUidQueues.size() - 1;
             }
+            mUidQueues.insert(mUidQueues.begin() + index, UidQueue{clientUid, {}});
+        } else if (index != 0 && mUidPolicy->isUidOnTop(clientUid)) {
+            // Move this uid's queue to the front.
+            std::rotate(mUidQueues.begin(), mUidQueues.begin() + index,
+                        mUidQueues.begin() + index + 1);
+            index = 0;
         }
     }
     // Append this session to the uid's queue.
-    mSessionQueues[clientUid].push_back(sessionKey);
+    mUidQueues[index].queue.push_back(sessionKey);
+
+    mTopSessionDirty = true;
 }
 
 void TranscodingSessionController::removeSession_l(
@@ -600,15 +638,19 @@ void TranscodingSessionController::removeSession_l(
         const std::shared_ptr<std::function<bool(uid_t uid)>>& keepUid) {
     ALOGV("%s: session %s", __FUNCTION__, sessionToString(sessionKey).c_str());
 
-    if (mSessionMap.count(sessionKey) == 0) {
+    auto sessionIt = mSessionMap.find(sessionKey);
+    if (sessionIt == mSessionMap.end()) {
         ALOGE("session %s doesn't exist", sessionToString(sessionKey).c_str());
         return;
     }
+    Session& session = sessionIt->second;
+
+    mTopSessionDirty = true;
 
     // Remove session from uid's queue.
     bool uidQueueRemoved = false;
     std::unordered_set<uid_t> remainingUids;
-    for (uid_t uid : mSessionMap[sessionKey].allClientUids) {
+    for (uid_t uid : session.allClientUids) {
         if (keepUid != nullptr) {
             if ((*keepUid)(uid)) {
                 remainingUids.insert(uid);
@@ -619,7 +661,12 @@ void TranscodingSessionController::removeSession_l(
             // not be valid. Only notify pacer to stop tracking this session.
             mPacer->onSessionCancelled(uid);
         }
-        SessionQueueType& sessionQueue = mSessionQueues[uid];
+        size_t index = findUidQueueIndex_l(uid);
+        if (index == mUidQueues.size()) {
+            ALOGW("couldn't find queue for uid %d", uid);
+            continue;
+        }
+        SessionQueueType& sessionQueue = mUidQueues[index].queue;
         auto it = std::find(sessionQueue.begin(), sessionQueue.end(), sessionKey);
         if (it == sessionQueue.end()) {
             ALOGW("couldn't find session %s in queue for uid %d",
@@ -630,8 +677,7 @@ void TranscodingSessionController::removeSession_l(
 
         // If this is the last session in a real-time queue, remove this uid's queue.
         if (uid != OFFLINE_UID && sessionQueue.empty()) {
-            mUidSortedList.remove(uid);
-            mSessionQueues.erase(uid);
+            mUidQueues.erase(mUidQueues.begin() + index);
             mUidPolicy->unregisterMonitorUid(uid);
 
             uidQueueRemoved = true;
@@ -639,50 +685,57 @@ void TranscodingSessionController::removeSession_l(
     }
 
     if (uidQueueRemoved) {
-        std::unordered_set<uid_t> topUids = mUidPolicy->getTopUids();
+        std::unordered_set<uid_t> uids = mUidPolicy->getTopUids();
+        std::vector<uid_t> topUids(uids.begin(), uids.end());
+        std::sort(topUids.begin(), topUids.end());
         moveUidsToTop_l(topUids, false /*preserveTopUid*/);
     }
 
     if (keepUid != nullptr) {
-        mSessionMap[sessionKey].allClientUids = remainingUids;
+        session.allClientUids = remainingUids;
         return;
     }
 
     // Clear current session.
-    if (mCurrentSession == &mSessionMap[sessionKey]) {
+    if (mCurrentSession == &session) {
         mCurrentSession = nullptr;
     }
 
-    setSessionState_l(&mSessionMap[sessionKey], finalState);
+    setSessionState_l(&session, finalState);
 
     // We can use onSessionCompleted() even for CANCELLED, because runningTime is
     // now updated by setSessionState_l().
-    for (uid_t uid : mSessionMap[sessionKey].allClientUids) {
-        mPacer->onSessionCompleted(uid, mSessionMap[sessionKey].runningTime);
+    for (uid_t uid : session.allClientUids) {
+        mPacer->onSessionCompleted(uid, session.runningTime);
     }
 
-    mSessionHistory.push_back(mSessionMap[sessionKey]);
+    mSessionHistory.push_back(session);
     if (mSessionHistory.size() > kSessionHistoryMax) {
         mSessionHistory.erase(mSessionHistory.begin());
     }
 
-    // Remove session from session map.
-    mSessionMap.erase(sessionKey);
+    // Remove session from session map, recycling the node so the next submit()
+    // can reuse its Session storage.
+    auto node = mSessionMap.extract(sessionIt);
+    if (mSessionNodePool.size() < kSessionNodePoolMax) {
+        node.mapped() = Session();
+        mSessionNodePool.push_back(std::move(node));
+    }
 }
 
 /**
- * Moves the set of uids to the front of mUidSortedList (which is used to pick
+ * Moves the set of uids to the front of mUidQueues (which is used to pick
  * the next session to run).
  *
  * This is called when 1) we received a onTopUidsChanged() callback from UidPolicy,
  * or 2) we removed the session queue for a uid because it becomes empty.
  *
  * In case of 1), if there are multiple uids in the set, and the current front
- * uid in mUidSortedList is still in the set, we try to keep that uid at front
+ * uid in mUidQueues is still in the set, we try to keep that uid at front
  * so that current session run is not interrupted. (This is not a concern for case 2)
  * because the queue for a uid was just removed entirely.)
  */
-void TranscodingSessionController::moveUidsToTop_l(const std::unordered_set<uid_t>& uids,
+void TranscodingSessionController::moveUidsToTop_l(const std::vector<uid_t>& uids,
                                                    bool preserveTopUid) {
     // If uid set is empty, nothing to do. Do not change the queue status.
     if (uids.empty()) {
@@ -690,37 +743,44 @@ void TranscodingSessionController::moveUidsToTop_l(const std::unordered_set<uid_
     }
 
     // Save the current top uid.
-    uid_t curTopUid = *mUidSortedList.begin();
+    uid_t curTopUid = mUidQueues.front().uid;
     bool pushCurTopToFront = false;
-    int32_t numUidsMoved = 0;
-
-    // Go through the sorted uid list once, and move the ones in top set to front.
-    for (auto it = mUidSortedList.begin(); it != mUidSortedList.end();) {
-        uid_t uid = *it;
-
-        if (uid != OFFLINE_UID && uids.count(uid) > 0) {
-            it = mUidSortedList.erase(it);
 
-            // If this is the top we're preserving, don't push it here, push
-            // it after the for-loop.
-            if (uid == curTopUid && preserveTopUid) {
+    // Go through the uid queues once, compacting the ones that are not moving
+    // in place while gathering the ones in the top set.
+    std::vector<UidQueue> movedQueues;
+    UidQueue preservedTopQueue{};
+    auto writeIt = mUidQueues.begin();
+    for (UidQueue& uidQueue : mUidQueues) {
+        if (uidQueue.uid != OFFLINE_UID &&
+            std::binary_search(uids.begin(), uids.end(), uidQueue.uid)) {
+            // If this is the top we're preserving, don't gather it here, push
+            // it to the front after the for-loop.
+            if (uidQueue.uid == curTopUid && preserveTopUid) {
+                preservedTopQueue = std::move(uidQueue);
                 pushCurTopToFront = true;
             } else {
-                mUidSortedList.push_front(uid);
-            }
-
-            // If we found all uids in the set, break out.
-            if (++numUidsMoved == uids.size()) {
-                break;
+                movedQueues.push_back(std::move(uidQueue));
             }
         } else {
-            ++it;
+            if (&*writeIt != &uidQueue) {
+                *writeIt = std::move(uidQueue);
+            }
+            ++writeIt;
         }
     }
+    mUidQueues.erase(writeIt, mUidQueues.end());
+
+    // Most recently encountered uid ends up at the front, matching the
+    // repeated push-front behavior this replaced.
+    mUidQueues.insert(mUidQueues.begin(), std::make_move_iterator(movedQueues.rbegin()),
+                      std::make_move_iterator(movedQueues.rend()));
 
     if (pushCurTopToFront) {
-        mUidSortedList.push_front(curTopUid);
+        mUidQueues.insert(mUidQueues.begin(), std::move(preservedTopQueue));
     }
+
+    mTopSessionDirty = true;
 }
 
 bool TranscodingSessionController::submit(
@@ -734,9 +794,27 @@ bool TranscodingSessionController::submit(
 
     std::scoped_lock lock{mLock};
 
-    if (mSessionMap.count(sessionKey) > 0) {
-        ALOGE("session %s already exists", sessionToString(sessionKey).c_str());
-        return false;
+    // Add the session to the session map, detecting duplicates with the same
+    // single lookup, and reusing a recycled node if we have one.
+    Session* session;
+    if (!mSessionNodePool.empty()) {
+        auto node = std::move(mSessionNodePool.back());
+        mSessionNodePool.pop_back();
+        node.key() = sessionKey;
+        auto res = mSessionMap.insert(std::move(node));
+        if (!res.inserted) {
+            mSessionNodePool.push_back(std::move(res.node));
+            ALOGE("session %s already exists", sessionToString(sessionKey).c_str());
+            return false;
+        }
+        session = &res.position->second;
+    } else {
+        auto res = mSessionMap.try_emplace(sessionKey);
+        if (!res.second) {
+            ALOGE("session %s already exists", sessionToString(sessionKey).c_str());
+            return false;
+        }
+        session = &res.first->second;
     }
 
     // Add the uid package name to the store of package names we already know.
@@ -750,13 +828,12 @@ bool TranscodingSessionController::submit(
         clientUid = OFFLINE_UID;
     }
 
-    // Add session to session map.
-    mSessionMap[sessionKey].key = sessionKey;
-    mSessionMap[sessionKey].callingUid = callingUid;
-    mSessionMap[sessionKey].allClientUids.insert(clientUid);
-    mSessionMap[sessionKey].request = request;
-    mSessionMap[sessionKey].callback = callback;
-    setSessionState_l(&mSessionMap[sessionKey], Session::NOT_STARTED);
+    session->key = sessionKey;
+    session->callingUid = callingUid;
+    session->allClientUids.insert(clientUid);
+    session->request = request;
+    session->callback = callback;
+    setSessionState_l(session, Session::NOT_STARTED);
 
     addUidToSession_l(clientUid, sessionKey);
 
@@ -771,11 +848,21 @@ bool TranscodingSessionController::cancel(ClientIdType clientId, SessionIdType s
 
     ALOGV("%s: session %s", __FUNCTION__, sessionToString(sessionKey).c_str());
 
-    std::list<SessionKeyType> sessionsToRemove, sessionsForOffline;
-
     std::scoped_lock lock{mLock};
 
+    // Stops (if ever started) and removes one canceled session.
+    // Note that stop() is needed even if the session is currently paused. This instructs
+    // the transcoder to discard any states for the session, otherwise the states may
+    // never be discarded.
+    auto stopAndRemoveSession = [this](const SessionKeyType& key) {
+        if (mSessionMap.find(key)->second.getState() != Session::NOT_STARTED) {
+            mTranscoder->stop(key.first, key.second);
+        }
+        removeSession_l(key, Session::CANCELED);
+    };
+
     if (sessionId < 0) {
+        std::vector<SessionKeyType> sessionsToRemove, sessionsForOffline;
         for (auto it = mSessionMap.begin(); it != mSessionMap.end(); ++it) {
             if (it->first.first == clientId) {
                 // If there is offline request, only keep the offline client;
@@ -787,31 +874,24 @@ bool TranscodingSessionController::cancel(ClientIdType clientId, SessionIdType s
                 }
             }
         }
+
+        for (auto it = sessionsToRemove.begin(); it != sessionsToRemove.end(); ++it) {
+            stopAndRemoveSession(*it);
+        }
+
+        auto keepUid = std::make_shared<std::function<bool(uid_t)>>(
+                [](uid_t uid) { return uid == OFFLINE_UID; });
+        for (auto it = sessionsForOffline.begin(); it != sessionsForOffline.end(); ++it) {
+            removeSession_l(*it, Session::CANCELED, keepUid);
+        }
     } else {
+        // Single-session cancel, the common case; remove it directly without
+        // building removal lists on the heap.
         if (mSessionMap.count(sessionKey) == 0) {
             ALOGE("session %s doesn't exist", sessionToString(sessionKey).c_str());
             return false;
         }
-        sessionsToRemove.push_back(sessionKey);
-    }
-
-    for (auto it = sessionsToRemove.begin(); it != sessionsToRemove.end(); ++it) {
-        // If the session has ever been started, stop it now.
-        // Note that stop() is needed even if the session is currently paused. This instructs
-        // the transcoder to discard any states for the session, otherwise the states may
-        // never be discarded.
-        if (mSessionMap[*it].getState() != Session::NOT_STARTED) {
-            mTranscoder->stop(it->first, it->second);
-        }
-
-        // Remove the session.
-        removeSession_l(*it, Session::CANCELED);
-    }
-
-    auto keepUid = std::make_shared<std::function<bool(uid_t)>>(
-            [](uid_t uid) { return uid == OFFLINE_UID; });
-    for (auto it = sessionsForOffline.begin(); it != sessionsForOffline.end(); ++it) {
-        removeSession_l(*it, Session::CANCELED, keepUid);
+        stopAndRemoveSession(sessionKey);
     }
 
     // Start next session.
@@ -827,17 +907,18 @@ bool TranscodingSessionController::addClientUid(ClientIdType clientId, SessionId
 
     std::scoped_lock lock{mLock};
 
-    if (mSessionMap.count(sessionKey) == 0) {
+    auto sessionIt = mSessionMap.find(sessionKey);
+    if (sessionIt == mSessionMap.end()) {
         ALOGE("session %s doesn't exist", sessionToString(sessionKey).c_str());
         return false;
     }
 
-    if (mSessionMap[sessionKey].allClientUids.count(clientUid) > 0) {
+    if (sessionIt->second.allClientUids.count(clientUid) > 0) {
         ALOGE("session %s already has uid %d", sessionToString(sessionKey).c_str(), clientUid);
         return false;
     }
 
-    mSessionMap[sessionKey].allClientUids.insert(clientUid);
+    sessionIt->second.allClientUids.insert(clientUid);
     addUidToSession_l(clientUid, sessionKey);
 
     updateCurrentSession_l();
@@ -852,13 +933,14 @@ bool TranscodingSessionController::getClientUids(ClientIdType clientId, SessionI
 
     std::scoped_lock lock{mLock};
 
-    if (mSessionMap.count(sessionKey) == 0) {
+    auto sessionIt = mSessionMap.find(sessionKey);
+    if (sessionIt == mSessionMap.end()) {
         ALOGE("session %s doesn't exist", sessionToString(sessionKey).c_str());
         return false;
     }
 
     out_clientUids->clear();
-    for (uid_t uid : mSessionMap[sessionKey].allClientUids) {
+    for (uid_t uid : sessionIt->second.allClientUids) {
         if (uid != OFFLINE_UID) {
             out_clientUids->push_back(uid);
         }
@@ -872,23 +954,25 @@ bool TranscodingSessionController::getSession(ClientIdType clientId, SessionIdTy
 
     std::scoped_lock lock{mLock};
 
-    if (mSessionMap.count(sessionKey) == 0) {
+    auto sessionIt = mSessionMap.find(sessionKey);
+    if (sessionIt == mSessionMap.end()) {
         ALOGE("session %s doesn't exist", sessionToString(sessionKey).c_str());
         return false;
     }
 
-    *(TranscodingRequest*)request = mSessionMap[sessionKey].request;
+    *(TranscodingRequest*)request = sessionIt->second.request;
     return true;
 }
 
-void TranscodingSessionController::notifyClient(ClientIdType clientId, SessionIdType sessionId,
-                                                const char* reason,
-                                                std::function<void(const SessionKeyType&)> func) {
+void TranscodingSessionController::notifyClient(
+        ClientIdType clientId, SessionIdType sessionId, const char* reason,
+        std::function<void(Session&, const std::shared_ptr<ITranscodingClientCallback>&)> func) {
     SessionKeyType sessionKey = std::make_pair(clientId, sessionId);
 
     std::scoped_lock lock{mLock};
 
-    if (mSessionMap.count(sessionKey) == 0) {
+    auto sessionIt = mSessionMap.find(sessionKey);
+    if (sessionIt == mSessionMap.end()) {
         ALOGW("%s: ignoring %s for session %s that doesn't exist", __FUNCTION__, reason,
               sessionToString(sessionKey).c_str());
         return;
@@ -897,56 +981,55 @@ void TranscodingSessionController::notifyClient(ClientIdType clientId, SessionId
     // Only ignore if session was never started. In particular, propagate the status
     // to client if the session is paused. Transcoder could have posted finish when
     // we're pausing it, and the finish arrived after we changed current session.
-    if (mSessionMap[sessionKey].getState() == Session::NOT_STARTED) {
+    if (sessionIt->second.getState() == Session::NOT_STARTED) {
         ALOGW("%s: ignoring %s for session %s that was never started", __FUNCTION__, reason,
               sessionToString(sessionKey).c_str());
         return;
     }
 
     ALOGV("%s: session %s %s", __FUNCTION__, sessionToString(sessionKey).c_str(), reason);
-    func(sessionKey);
+    func(sessionIt->second, sessionIt->second.callback.lock());
 }
 
 void TranscodingSessionController::onStarted(ClientIdType clientId, SessionIdType sessionId) {
-    notifyClient(clientId, sessionId, "started", [=](const SessionKeyType& sessionKey) {
-        auto callback = mSessionMap[sessionKey].callback.lock();
-        if (callback != nullptr) {
-            callback->onTranscodingStarted(sessionId);
-        }
-    });
+    notifyClient(clientId, sessionId, "started",
+                 [=](Session& /*session*/, const std::shared_ptr<ITranscodingClientCallback>& callback) {
+                     if (callback != nullptr) {
+                         callback->onTranscodingStarted(sessionId);
+                     }
+                 });
 }
 
 void TranscodingSessionController::onPaused(ClientIdType clientId, SessionIdType sessionId) {
-    notifyClient(clientId, sessionId, "paused", [=](const SessionKeyType& sessionKey) {
-        auto callback = mSessionMap[sessionKey].callback.lock();
-        if (callback != nullptr) {
-            callback->onTranscodingPaused(sessionId);
-        }
-    });
+    notifyClient(clientId, sessionId, "paused",
+                 [=](Session& /*session*/, const std::shared_ptr<ITranscodingClientCallback>& callback) {
+                     if (callback != nullptr) {
+                         callback->onTranscodingPaused(sessionId);
+                     }
+                 });
 }
 
 void TranscodingSessionController::onResumed(ClientIdType clientId, SessionIdType sessionId) {
-    notifyClient(clientId, sessionId, "resumed", [=](const SessionKeyType& sessionKey) {
-        auto callback = mSessionMap[sessionKey].callback.lock();
-        if (callback != nullptr) {
-            callback->onTranscodingResumed(sessionId);
-        }
-    });
+    notifyClient(clientId, sessionId, "resumed",
+                 [=](Session& /*session*/, const std::shared_ptr<ITranscodingClientCallback>& callback) {
+                     if (callback != nullptr) {
+                         callback->onTranscodingResumed(sessionId);
+                     }
+                 });
 }
 
 void TranscodingSessionController::onFinish(ClientIdType clientId, SessionIdType sessionId) {
-    notifyClient(clientId, sessionId, "finish", [=](const SessionKeyType& sessionKey) {
-        {
-            auto clientCallback = mSessionMap[sessionKey].callback.lock();
-            if (clientCallback != nullptr) {
-                clientCallback->onTranscodingFinished(
-                        sessionId, TranscodingResultParcel({sessionId, -1 /*actualBitrateBps*/,
-                                                            std::nullopt /*sessionStats*/}));
-            }
+    notifyClient(clientId, sessionId, "finish", [=](Session& session,
+                                                    const std::shared_ptr<ITranscodingClientCallback>&
+                                                            clientCallback) {
+        if (clientCallback != nullptr) {
+            clientCallback->onTranscodingFinished(
+                    sessionId, TranscodingResultParcel({sessionId, -1 /*actualBitrateBps*/,
+                                                        std::nullopt /*sessionStats*/}));
         }
 
         // Remove the session.
-        removeSession_l(sessionKey, Session::FINISHED);
+        removeSession_l(session.key, Session::FINISHED);
 
         // Start next session.
         updateCurrentSession_l();
@@ -957,7 +1040,9 @@ void TranscodingSessionController::onFinish(ClientIdType clientId, SessionIdType
 
 void TranscodingSessionController::onError(ClientIdType clientId, SessionIdType sessionId,
                                            TranscodingErrorCode err) {
-    notifyClient(clientId, sessionId, "error", [=](const SessionKeyType& sessionKey) {
+    notifyClient(clientId, sessionId, "error", [=](Session& session,
+                                                   const std::shared_ptr<ITranscodingClientCallback>&
+                                                           clientCallback) {
         if (err == TranscodingErrorCode::kWatchdogTimeout) {
             // Abandon the transcoder, as its handler thread might be stuck in some call to
             // MediaTranscoder altogether, and may not be able to handle any new tasks.
@@ -967,15 +1052,12 @@ void TranscodingSessionController::onError(ClientIdType clientId, SessionIdType
             mTranscoder = mTranscoderFactory(shared_from_this());
         }
 
-        {
-            auto clientCallback = mSessionMap[sessionKey].callback.lock();
-            if (clientCallback != nullptr) {
-                clientCallback->onTranscodingFailed(sessionId, err);
-            }
+        if (clientCallback != nullptr) {
+            clientCallback->onTranscodingFailed(sessionId, err);
         }
 
         // Remove the session.
-        removeSession_l(sessionKey, Session::ERROR);
+        removeSession_l(session.key, Session::ERROR);
 
         // Start next session.
         updateCurrentSession_l();
@@ -986,32 +1068,36 @@ void TranscodingSessionController::onError(ClientIdType clientId, SessionIdType
 
 void TranscodingSessionController::onProgressUpdate(ClientIdType clientId, SessionIdType sessionId,
                                                     int32_t progress) {
-    notifyClient(clientId, sessionId, "progress", [=](const SessionKeyType& sessionKey) {
-        auto callback = mSessionMap[sessionKey].callback.lock();
-        if (callback != nullptr) {
-            callback->onProgressUpdate(sessionId, progress);
-        }
-        mSessionMap[sessionKey].lastProgress = progress;
-    });
+    notifyClient(clientId, sessionId, "progress",
+                 [=](Session& session, const std::shared_ptr<ITranscodingClientCallback>& callback) {
+                     if (callback != nullptr) {
+                         callback->onProgressUpdate(sessionId, progress);
+                     }
+                     session.lastProgress = progress;
+                 });
 }
 
 void TranscodingSessionController::onHeartBeat(ClientIdType clientId, SessionIdType sessionId) {
     notifyClient(clientId, sessionId, "heart-beat",
-                 [=](const SessionKeyType& /*sessionKey*/) { mWatchdog->keepAlive(); });
+                 [=](Session& /*session*/, const std::shared_ptr<ITranscodingClientCallback>&
+                     /*callback*/) { mWatchdog->keepAlive(); });
 }
 
 void TranscodingSessionController::onResourceLost(ClientIdType clientId, SessionIdType sessionId) {
     ALOGI("%s", __FUNCTION__);
 
-    notifyClient(clientId, sessionId, "resource_lost", [=](const SessionKeyType& sessionKey) {
+    notifyClient(clientId, sessionId, "resource_lost", [=](Session& session,
+                                                           const std::shared_ptr<
+                                                                   ITranscodingClientCallback>&
+                                                                   clientCallback) {
         if (mResourceLost) {
             return;
         }
 
-        Session* resourceLostSession = &mSessionMap[sessionKey];
+        Session* resourceLostSession = &session;
         if (resourceLostSession->getState() != Session::RUNNING) {
             ALOGW("session %s lost resource but is no longer running",
-                  sessionToString(sessionKey).c_str());
+                  sessionToString(session.key).c_str());
             return;
         }
         // If we receive a resource loss event, the transcoder already paused the transcoding,
@@ -1019,9 +1105,8 @@ void TranscodingSessionController::onResourceLost(ClientIdType clientId, Session
         // the client and update the session state here.
         setSessionState_l(resourceLostSession, Session::PAUSED);
         // Notify the client as a paused event.
-        auto clientCallback = resourceLostSession->callback.lock();
         if (clientCallback != nullptr) {
-            clientCallback->onTranscodingPaused(sessionKey.second);
+            clientCallback->onTranscodingPaused(session.key.second);
         }
         if (mResourcePolicy != nullptr) {
             mResourcePolicy->setPidResourceLost(resourceLostSession->request.clientPid);
@@ -1038,19 +1123,25 @@ void TranscodingSessionController::onTopUidsChanged(const std::unordered_set<uid
         return;
     }
 
-    std::string uidStr;
-    for (auto it = uids.begin(); it != uids.end(); it++) {
-        if (!uidStr.empty()) {
-            uidStr += ", ";
+    // Copy the set into a small sorted vector for moveUidsToTop_l.
+    std::vector<uid_t> topUids(uids.begin(), uids.end());
+    std::sort(topUids.begin(), topUids.end());
+
+    // Only materialize the uid list string when ALOGD is actually loggable.
+    IF_ALOGD() {
+        std::string uidStr;
+        for (uid_t uid : topUids) {
+            if (!uidStr.empty()) {
+                uidStr += ", ";
+            }
+            uidStr += std::to_string(uid);
         }
-        uidStr += std::to_string(*it);
+        ALOGD("%s: topUids: size %zu, uids: %s", __FUNCTION__, uids.size(), uidStr.c_str());
     }
 
-    ALOGD("%s: topUids: size %zu, uids: %s", __FUNCTION__, uids.size(), uidStr.c_str());
-
     std::scoped_lock lock{mLock};
 
-    moveUidsToTop_l(uids, true /*preserveTopUid*/);
+    moveUidsToTop_l(topUids, true /*preserveTopUid*/);
 
     updateCurrentSession_l();
 
@@ -1081,12 +1172,13 @@ void TranscodingSessionController::onUidGone(uid_t goneUid) {
         // Note that stop() is needed even if the session is currently paused. This instructs
         // the transcoder to discard any states for the session, otherwise the states may
         // never be discarded.
-        if (mSessionMap[*it].getState() != Session::NOT_STARTED) {
+        Session& session = mSessionMap.find(*it)->second;
+        if (session.getState() != Session::NOT_STARTED) {
             mTranscoder->stop(it->first, it->second);
         }
 
         {
-            auto clientCallback = mSessionMap[*it].callback.lock();
+            auto clientCallback = session.callback.lock();
             if (clientCallback != nullptr) {
                 clientCallback->onTranscodingFailed(it->second,
                                                     TranscodingErrorCode::kUidGoneCancelled);
@@ -1156,32 +1248,34 @@ void TranscodingSessionController::onThrottlingStopped() {
 
 void TranscodingSessionController::validateState_l() {
 #ifdef VALIDATE_STATE
-    LOG_ALWAYS_FATAL_IF(mSessionQueues.count(OFFLINE_UID) != 1,
-                        "mSessionQueues offline queue number is not 1");
-    LOG_ALWAYS_FATAL_IF(*mOfflineUidIterator != OFFLINE_UID,
-                        "mOfflineUidIterator not pointing to offline uid");
-    LOG_ALWAYS_FATAL_IF(mUidSortedList.size() != mSessionQueues.size(),
-                        "mUidSortedList and mSessionQueues size mismatch, %zu vs %zu",
-                        mUidSortedList.size(), mSessionQueues.size());
+    int32_t offlineQueueCount = 0;
+    for (auto& uidQueue : mUidQueues) {
+        if (uidQueue.uid == OFFLINE_UID) {
+            offlineQueueCount++;
+        }
+    }
+    LOG_ALWAYS_FATAL_IF(offlineQueueCount != 1, "mUidQueues offline queue number is not 1");
+    LOG_ALWAYS_FATAL_IF(mUidQueues.back().uid != OFFLINE_UID,
+                        "mUidQueues not ending with the offline uid");
 
     int32_t totalSessions = 0;
-    for (auto uid : mUidSortedList) {
-        LOG_ALWAYS_FATAL_IF(mSessionQueues.count(uid) != 1,
-                            "mSessionQueues count for uid %d is not 1", uid);
-        for (auto& sessionKey : mSessionQueues[uid]) {
+    for (auto& uidQueue : mUidQueues) {
+        LOG_ALWAYS_FATAL_IF(findUidQueueIndex_l(uidQueue.uid) != (size_t)(&uidQueue - &mUidQueues[0]),
+                            "duplicate queue for uid %d", uidQueue.uid);
+        for (auto& sessionKey : uidQueue.queue) {
             LOG_ALWAYS_FATAL_IF(mSessionMap.count(sessionKey) != 1,
                                 "mSessions count for session %s is not 1",
                                 sessionToString(sessionKey).c_str());
         }
 
-        totalSessions += mSessionQueues[uid].size();
+        totalSessions += uidQueue.queue.size();
     }
     int32_t totalSessionsAlternative = 0;
     for (auto const& s : mSessionMap) {
         totalSessionsAlternative += s.second.allClientUids.size();
     }
     LOG_ALWAYS_FATAL_IF(totalSessions != totalSessionsAlternative,
-                        "session count (including dup) from mSessionQueues doesn't match that from "
+                        "session count (including dup) from mUidQueues doesn't match that from "
                         "mSessionMap, %d vs %d",
                         totalSessions, totalSessionsAlternative);
 #endif  // VALIDATE_STATE
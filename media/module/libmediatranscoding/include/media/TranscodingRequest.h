@@ -34,6 +34,13 @@ public:
         setTo(request);
         return *this;
     }
+    // Assigning from a plain parcel directly; without this overload the
+    // assignment would duplicate the parcel twice (once into a converting
+    // temporary, once into *this).
+    TranscodingRequest& operator=(const TranscodingRequestParcel& parcel) {
+        setTo(parcel);
+        return *this;
+    }
 
 private:
     void setTo(const TranscodingRequestParcel& parcel) {
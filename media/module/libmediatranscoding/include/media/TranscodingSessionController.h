@@ -32,6 +32,8 @@
 #include <list>
 #include <map>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 namespace android {
 using ::aidl::android::media::TranscodingResultParcel;
@@ -95,7 +97,9 @@ private:
     friend class TranscodingSessionControllerTest;
 
     using SessionKeyType = std::pair<ClientIdType, SessionIdType>;
-    using SessionQueueType = std::list<SessionKeyType>;
+    // Per-uid queues are short and searched linearly on removal; a vector keeps
+    // the keys contiguous and avoids a node allocation per queued session.
+    using SessionQueueType = std::vector<SessionKeyType>;
     using TranscoderFactoryType = std::function<std::shared_ptr<TranscoderInterface>(
             const std::shared_ptr<TranscoderCallbackInterface>&)>;
 
@@ -123,46 +127,86 @@ private:
             ERROR,
             DROPPED_BY_PACER,
         };
+
+    private:
+        // Declared first so that the state word is laid out together with the
+        // hot fields below.
+        State state = INVALID;
+
+    public:
+        // Fields touched by the scheduling walk (getTopSession_l, updateCurrentSession_l,
+        // validateState_l) are grouped at the head of the struct, so that picking the next
+        // session only pulls in the first bytes of each Session. The bulky request/callback
+        // below are only needed when a session is started/resumed, queried or dumped.
         SessionKeyType key;
         uid_t callingUid;
-        std::unordered_set<uid_t> allClientUids;
         int32_t lastProgress = 0;
         int32_t pauseCount = 0;
+        std::unordered_set<uid_t> allClientUids;
         std::chrono::time_point<std::chrono::steady_clock> stateEnterTime;
         std::chrono::microseconds waitingTime{0};
         std::chrono::microseconds runningTime{0};
         std::chrono::microseconds pausedTime{0};
 
-        TranscodingRequest request;
+        // Cold fields, not needed for scheduling decisions. The cache-line
+        // alignment keeps the request data off the line(s) holding the hot
+        // fields above, so a scheduling scan never pulls in request bytes.
+        alignas(64) TranscodingRequest request;
         std::weak_ptr<ITranscodingClientCallback> callback;
 
         // Must use setState to change state.
         void setState(Session::State state);
         State getState() const { return state; }
         bool isRunning() { return state == RUNNING; }
-
-    private:
-        State state = INVALID;
     };
 
+    static_assert(alignof(Session) >= 64, "Session hot/cold fields should split at a cache line");
+
     struct Watchdog;
     struct Pacer;
 
+    // Hasher for SessionKeyType (std::hash doesn't cover std::pair). Folds the
+    // client id and session id into a single 64-bit word and hashes that once,
+    // instead of hashing the two halves separately and mixing. Client ids are
+    // pointer-derived and session ids are small per-client counters, so the
+    // fold keeps distinct keys distinct in practice.
+    struct SessionKeyHash {
+        std::size_t operator()(const SessionKeyType& sessionKey) const {
+            uint64_t packed = (static_cast<uint64_t>(sessionKey.first) << 1) ^
+                              static_cast<uint32_t>(sessionKey.second);
+            return std::hash<uint64_t>()(packed);
+        }
+    };
+    // Sessions are looked up by key on every controller entrypoint; use a hash map
+    // so each lookup costs one hash instead of an ordered-tree walk. Note this must
+    // remain a node-based container: Session addresses (e.g. mCurrentSession) must
+    // stay stable across insertions.
+    using SessionMapType = std::unordered_map<SessionKeyType, Session, SessionKeyHash>;
+
     ControllerConfig mConfig;
 
     // TODO(chz): call transcoder without global lock.
     // Use mLock for all entrypoints for now.
     mutable std::mutex mLock;
 
-    std::map<SessionKeyType, Session> mSessionMap;
+    SessionMapType mSessionMap;
 
-    // uid->SessionQueue map (uid == -1: offline queue)
-    std::map<uid_t, SessionQueueType> mSessionQueues;
+    // Recycled mSessionMap nodes. Bursty submit/remove cycles reuse the Session
+    // storage from here instead of going back to the allocator each time.
+    std::vector<SessionMapType::node_type> mSessionNodePool;
 
-    // uids, with the head being the most-recently-top app, 2nd item is the
-    // previous top app, etc.
-    std::list<uid_t> mUidSortedList;
-    std::list<uid_t>::iterator mOfflineUidIterator;
+    struct UidQueue {
+        uid_t uid;
+        SessionQueueType queue;
+    };
+
+    // Per-uid session queues (uid == -1: offline queue), in scheduling order:
+    // the head is the most-recently-top app, the 2nd entry the previous top
+    // app, etc., and the offline queue is always the last entry. Uid counts
+    // are small, so storing the queues in a flat vector in scheduling order
+    // keeps the walks contiguous and makes uid lookup a short linear scan,
+    // replacing the former parallel sorted-uid list and uid->queue map.
+    std::vector<UidQueue> mUidQueues;
     std::map<uid_t, std::string> mUidPackageNames;
 
     TranscoderFactoryType mTranscoderFactory;
@@ -172,6 +216,13 @@ private:
     std::shared_ptr<ThermalPolicyInterface> mThermalPolicy;
 
     Session* mCurrentSession;
+    // Cached top uid and front-of-queue session for getTopSession_l(). Only
+    // recomputed when the queues or the uid order change (mTopSessionDirty),
+    // so high-frequency events that don't move the top (e.g. progress updates)
+    // skip the container lookups.
+    uid_t mCachedTopUid;
+    Session* mCachedTopSession;
+    bool mTopSessionDirty;
     bool mResourceLost;
     bool mThermalThrottling;
     std::list<Session> mSessionHistory;
@@ -185,20 +236,34 @@ private:
                                  const std::shared_ptr<ThermalPolicyInterface>& thermalPolicy,
                                  const ControllerConfig* config = nullptr);
 
-    void dumpSession_l(const Session& session, String8& result, bool closedSession = false);
+    void dumpSession_l(const Session& session, std::string& result, bool closedSession = false);
+    // Returns the index of |uid|'s queue in mUidQueues, or mUidQueues.size() if absent.
+    size_t findUidQueueIndex_l(uid_t uid) const;
     Session* getTopSession_l();
     void updateCurrentSession_l();
     void addUidToSession_l(uid_t uid, const SessionKeyType& sessionKey);
     void removeSession_l(const SessionKeyType& sessionKey, Session::State finalState,
                          const std::shared_ptr<std::function<bool(uid_t uid)>>& keepUid = nullptr);
-    void moveUidsToTop_l(const std::unordered_set<uid_t>& uids, bool preserveTopUid);
+    // |uids| must be sorted; it's probed once per entry of mUidQueues.
+    void moveUidsToTop_l(const std::vector<uid_t>& uids, bool preserveTopUid);
     void setSessionState_l(Session* session, Session::State state);
-    void notifyClient(ClientIdType clientId, SessionIdType sessionId, const char* reason,
-                      std::function<void(const SessionKeyType&)> func);
+    // Looks up the session and locks its client callback once, then hands both
+    // to |func|; the handlers must not re-look-up the session or re-lock the
+    // callback. |callback| may be null if the client is gone — handlers that
+    // have cleanup to do must still run.
+    void notifyClient(
+            ClientIdType clientId, SessionIdType sessionId, const char* reason,
+            std::function<void(Session&, const std::shared_ptr<ITranscodingClientCallback>&)> func);
     // Internal state verifier (debug only)
     void validateState_l();
 
-    static String8 sessionToString(const SessionKeyType& sessionKey);
+    // Stack-held string form of a session key, so every log site can format
+    // the key without a heap allocation.
+    struct SessionKeyString {
+        char buffer[48];
+        const char* c_str() const { return buffer; }
+    };
+    static SessionKeyString sessionToString(const SessionKeyType& sessionKey);
     static const char* sessionStateToString(const Session::State sessionState);
 };
 
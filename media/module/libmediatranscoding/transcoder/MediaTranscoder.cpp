@@ -28,6 +28,8 @@
 #include <sys/prctl.h>
 #include <unistd.h>
 
+#include <iterator>
+
 namespace android {
 
 static std::shared_ptr<AMediaFormat> createVideoTrackFormat(AMediaFormat* srcFormat,
@@ -38,7 +40,8 @@ static std::shared_ptr<AMediaFormat> createVideoTrackFormat(AMediaFormat* srcFor
     }
 
     // ------- Define parameters to copy from the source track format -------
-    std::vector<AMediaFormatUtils::EntryCopier> srcParamsToCopy{
+    // Profile and level are intentionally last so they can be dropped by shrinking the count.
+    static const AMediaFormatUtils::EntryCopier kSrcParamsToCopy[] = {
             ENTRY_COPIER(AMEDIAFORMAT_KEY_MIME, String),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_DURATION, Int64),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_WIDTH, Int32),
@@ -47,20 +50,22 @@ static std::shared_ptr<AMediaFormat> createVideoTrackFormat(AMediaFormat* srcFor
             ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_RANGE, Int32),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_STANDARD, Int32),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_TRANSFER, Int32),
+            ENTRY_COPIER(AMEDIAFORMAT_KEY_PROFILE, Int32),
+            ENTRY_COPIER(AMEDIAFORMAT_KEY_LEVEL, Int32),
     };
 
     // If the destination codec is the same as the source codec, we can preserve profile and level
     // from the source track as default values. Otherwise leave them unspecified.
+    size_t srcParamsCount = std::size(kSrcParamsToCopy);
     const char *srcMime, *dstMime;
     AMediaFormat_getString(srcFormat, AMEDIAFORMAT_KEY_MIME, &srcMime);
-    if (!AMediaFormat_getString(options, AMEDIAFORMAT_KEY_MIME, &dstMime) ||
-        strcmp(srcMime, dstMime) == 0) {
-        srcParamsToCopy.push_back(ENTRY_COPIER(AMEDIAFORMAT_KEY_PROFILE, Int32));
-        srcParamsToCopy.push_back(ENTRY_COPIER(AMEDIAFORMAT_KEY_LEVEL, Int32));
+    if (AMediaFormat_getString(options, AMEDIAFORMAT_KEY_MIME, &dstMime) &&
+        strcmp(srcMime, dstMime) != 0) {
+        srcParamsCount -= 2;  // Drop profile and level.
     }
 
     // ------- Define parameters to copy from the caller's options -------
-    static const std::vector<AMediaFormatUtils::EntryCopier> kSupportedOptions{
+    static const AMediaFormatUtils::EntryCopier kSupportedOptions[] = {
             ENTRY_COPIER(AMEDIAFORMAT_KEY_MIME, String),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_DURATION, Int64),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_WIDTH, Int32),
@@ -79,8 +84,10 @@ static std::shared_ptr<AMediaFormat> createVideoTrackFormat(AMediaFormat* srcFor
 
     // ------- Copy parameters from source and options to the destination -------
     auto trackFormat = std::shared_ptr<AMediaFormat>(AMediaFormat_new(), &AMediaFormat_delete);
-    AMediaFormatUtils::CopyFormatEntries(srcFormat, trackFormat.get(), srcParamsToCopy);
-    AMediaFormatUtils::CopyFormatEntries(options, trackFormat.get(), kSupportedOptions);
+    AMediaFormatUtils::CopyFormatEntries(srcFormat, trackFormat.get(), kSrcParamsToCopy,
+                                         srcParamsCount);
+    AMediaFormatUtils::CopyFormatEntries(options, trackFormat.get(), kSupportedOptions,
+                                         std::size(kSupportedOptions));
     return trackFormat;
 }
 
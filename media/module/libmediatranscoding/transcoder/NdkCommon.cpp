@@ -61,23 +61,28 @@ DEFINE_FORMAT_VALUE_COPY_FUNC(int64_t, Int64);
 DEFINE_FORMAT_VALUE_COPY_FUNC(int32_t, Int32);
 DEFINE_FORMAT_VALUE_COPY_FUNC(float, Float);
 
-void CopyFormatEntries(AMediaFormat* from, AMediaFormat* to,
-                       const std::vector<EntryCopier>& entries) {
+void CopyFormatEntries(AMediaFormat* from, AMediaFormat* to, const EntryCopier* entries,
+                       size_t entryCount) {
     if (from == nullptr || to == nullptr) {
         LOG(ERROR) << "Cannot copy null formats";
         return;
-    } else if (entries.empty()) {
+    } else if (entryCount == 0) {
         LOG(WARNING) << "No entries to copy";
         return;
     }
 
-    for (auto& entry : entries) {
-        if (!entry.copy(entry.key, from, to) && entry.copy2 != nullptr) {
-            entry.copy2(entry.key, from, to);
+    for (size_t i = 0; i < entryCount; ++i) {
+        if (!entries[i].copy(entries[i].key, from, to) && entries[i].copy2 != nullptr) {
+            entries[i].copy2(entries[i].key, from, to);
         }
     }
 }
 
+void CopyFormatEntries(AMediaFormat* from, AMediaFormat* to,
+                       const std::vector<EntryCopier>& entries) {
+    CopyFormatEntries(from, to, entries.data(), entries.size());
+}
+
 #define DEFINE_SET_DEFAULT_FORMAT_VALUE_FUNC(_type, _typeName)                                  \
     bool SetDefaultFormatValue##_typeName(const char* key, AMediaFormat* format, _type value) { \
         _type tmp;                                                                              \
@@ -23,6 +23,10 @@
 #include <media/VideoTrackTranscoder.h>
 #include <sys/prctl.h>
 
+#include <iterator>
+#include <new>
+#include <type_traits>
+
 using namespace AMediaFormatUtils;
 
 namespace android {
@@ -54,39 +58,87 @@ static constexpr int32_t kDefaultFrameRate = 30;
 static constexpr int32_t kDefaultCodecComplexity = 1;
 
 template <typename T>
-void VideoTrackTranscoder::BlockingQueue<T>::push(T const& value, bool front) {
+void VideoTrackTranscoder::BlockingQueue<T>::grow() {
+    std::vector<T> slots(mSlots.size() * 2);
+    for (size_t i = 0; i < mCount; ++i) {
+        slots[i] = std::move(mSlots[(mHead + i) % mSlots.size()]);
+    }
+    mSlots.swap(slots);
+    mHead = 0;
+}
+
+template <typename T>
+void VideoTrackTranscoder::BlockingQueue<T>::push(T&& value) {
+    bool consumerWaiting;
     {
         std::scoped_lock lock(mMutex);
         if (mAborted) {
             return;
         }
 
-        if (front) {
-            mQueue.push_front(value);
-        } else {
-            mQueue.push_back(value);
+        if (mCount == mSlots.size()) {
+            grow();
         }
+        mSlots[(mHead + mCount) % mSlots.size()] = std::move(value);
+        ++mCount;
+        consumerWaiting = mConsumerWaiting;
+    }
+    // Only issue the wakeup when the consumer is actually blocked in drain. If it is busy
+    // processing a previous batch it will re-check the queue before waiting, so skipping the
+    // notify saves a futex syscall per push without missing a wakeup. The flag is read under
+    // the same mutex the consumer sets it under, so there is no race with the wait.
+    if (consumerWaiting) {
+        mCondition.notify_one();
     }
-    mCondition.notify_one();
 }
 
 template <typename T>
-T VideoTrackTranscoder::BlockingQueue<T>::pop() {
+void VideoTrackTranscoder::BlockingQueue<T>::drain(std::vector<T>* out) {
     std::unique_lock lock(mMutex);
-    while (mQueue.empty()) {
+    while (mCount == 0 && !mWakeup && !mAborted) {
+        mConsumerWaiting = true;
         mCondition.wait(lock);
     }
-    T value = mQueue.front();
-    mQueue.pop_front();
-    return value;
+    mConsumerWaiting = false;
+    mWakeup = false;
+    for (size_t i = 0; i < mCount; ++i) {
+        const size_t slot = (mHead + i) % mSlots.size();
+        out->push_back(std::move(mSlots[slot]));
+        // Reset the slot so that it doesn't keep captured state alive until reuse.
+        mSlots[slot] = T();
+    }
+    mHead = (mHead + mCount) % mSlots.size();
+    mCount = 0;
+}
+
+template <typename T>
+void VideoTrackTranscoder::BlockingQueue<T>::wake() {
+    bool consumerWaiting;
+    {
+        std::scoped_lock lock(mMutex);
+        mWakeup = true;
+        consumerWaiting = mConsumerWaiting;
+    }
+    if (consumerWaiting) {
+        mCondition.notify_one();
+    }
 }
 
-// Note: Do not call if another thread might waiting in pop.
 template <typename T>
 void VideoTrackTranscoder::BlockingQueue<T>::abort() {
-    std::scoped_lock lock(mMutex);
-    mAborted = true;
-    mQueue.clear();
+    bool consumerWaiting;
+    {
+        std::scoped_lock lock(mMutex);
+        mAborted = true;
+        for (size_t i = 0; i < mCount; ++i) {
+            mSlots[(mHead + i) % mSlots.size()] = T();
+        }
+        mCount = 0;
+        consumerWaiting = mConsumerWaiting;
+    }
+    if (consumerWaiting) {
+        mCondition.notify_all();
+    }
 }
 
 // The CodecWrapper class is used to let AMediaCodec instances outlive the transcoder object itself
@@ -114,15 +166,134 @@ private:
     bool mCodecStarted;
 };
 
-// Dispatch responses to codec callbacks onto the message queue.
+// Recycles MediaSample objects so that steady-state transcoding reuses a bounded set of samples
+// (at most one per outstanding encoder output buffer) instead of allocating and freeing one per
+// encoded frame. The pool is kept alive by the release path of the samples it hands out, since
+// downstream consumers may hold on to samples after the transcoder itself is released — the same
+// reason the encoder is wrapped in CodecWrapper.
+class VideoTrackTranscoder::SamplePool
+      : public std::enable_shared_from_this<VideoTrackTranscoder::SamplePool> {
+public:
+    // Sets the encoder that samples' output buffers are released back to. Must be called before
+    // the first acquireSample call and is not changed afterwards, so the release path can read
+    // the wrapper without locking. The pool's reference also keeps the codec alive for as long
+    // as any outstanding sample needs it.
+    void setEncoder(const std::shared_ptr<CodecWrapper>& encoder) { mEncoder = encoder; }
+
+    // Returns a sample backed by |buffer|, reusing a pooled instance when one is free. When the
+    // last reference to the sample is dropped the encoder output buffer is released back to the
+    // encoder and the sample instance returns to the pool.
+    std::shared_ptr<MediaSample> acquireSample(uint8_t* buffer, size_t dataOffset,
+                                               uint32_t bufferId) {
+        std::unique_ptr<MediaSample> sample;
+        {
+            std::scoped_lock lock(mMutex);
+            if (!mFreeSamples.empty()) {
+                sample = std::move(mFreeSamples.back());
+                mFreeSamples.pop_back();
+            }
+        }
+        if (sample == nullptr) {
+            sample = std::make_unique<MediaSample>();
+        }
+        sample->buffer = buffer;
+        sample->dataOffset = dataOffset;
+        sample->bufferId = bufferId;
+
+        return std::shared_ptr<MediaSample>(
+                sample.release(),
+                [pool = shared_from_this()](MediaSample* sample) {
+                    AMediaCodec_releaseOutputBuffer(pool->mEncoder->getCodec(), sample->bufferId,
+                                                    false /* render */);
+                    pool->returnSample(sample);
+                },
+                ControlBlockAllocator<MediaSample>(shared_from_this()));
+    }
+
+    ~SamplePool() {
+        for (void* block : mFreeBlocks) {
+            ::operator delete(block);
+        }
+    }
+
+private:
+    // Allocator passed to the shared_ptr constructor in acquireSample so that the sample's
+    // control block is recycled through the pool as well. Every control block created by that
+    // constructor has the same size, so a freed block can back any later acquisition, making a
+    // steady-state acquire entirely allocation free.
+    template <typename T>
+    struct ControlBlockAllocator {
+        using value_type = T;
+
+        explicit ControlBlockAllocator(std::shared_ptr<SamplePool> pool) : mPool(std::move(pool)) {}
+        template <typename U>
+        ControlBlockAllocator(const ControlBlockAllocator<U>& other) : mPool(other.mPool) {}
+
+        T* allocate(size_t count) {
+            return static_cast<T*>(mPool->allocateBlock(count * sizeof(T)));
+        }
+        void deallocate(T* block, size_t count) { mPool->freeBlock(block, count * sizeof(T)); }
+
+        std::shared_ptr<SamplePool> mPool;
+    };
+
+    void returnSample(MediaSample* sample) {
+        std::scoped_lock lock(mMutex);
+        mFreeSamples.emplace_back(sample);
+    }
+
+    void* allocateBlock(size_t size) {
+        {
+            std::scoped_lock lock(mMutex);
+            if (mBlockSize == 0) {
+                mBlockSize = size;
+            }
+            if (size == mBlockSize && !mFreeBlocks.empty()) {
+                void* block = mFreeBlocks.back();
+                mFreeBlocks.pop_back();
+                return block;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void freeBlock(void* block, size_t size) {
+        std::scoped_lock lock(mMutex);
+        if (size == mBlockSize) {
+            mFreeBlocks.push_back(block);
+        } else {
+            ::operator delete(block);
+        }
+    }
+
+    std::shared_ptr<CodecWrapper> mEncoder;
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<MediaSample>> mFreeSamples;
+    // Raw storage recycled between shared_ptr control blocks. All blocks have size mBlockSize,
+    // recorded on the first allocation.
+    std::vector<void*> mFreeBlocks;
+    size_t mBlockSize = 0;
+};
+
+// Dispatch responses to codec callbacks onto the message queue. Events are plain data copied
+// into the queue; the transcoding thread dispatches on the event kind in processCodecEvent.
+// The weak_ptr lock guards against callbacks arriving after the transcoder has been released.
 struct AsyncCodecCallbackDispatch {
+    // An event is copied into the queue on every codec callback; keep it a plain single-cache-
+    // line copy so the buffer info never spills into a separate allocation again.
+    static_assert(std::is_trivially_copyable<VideoTrackTranscoder::CodecEvent>::value,
+                  "CodecEvent must be trivially copyable");
+    static_assert(sizeof(VideoTrackTranscoder::CodecEvent) <= 64,
+                  "CodecEvent should fit in a single cache line");
+
     static void onAsyncInputAvailable(AMediaCodec* codec, void* userdata, int32_t index) {
         VideoTrackTranscoder::CodecWrapper* wrapper =
                 static_cast<VideoTrackTranscoder::CodecWrapper*>(userdata);
         if (auto transcoder = wrapper->getTranscoder()) {
             if (codec == transcoder->mDecoder) {
                 transcoder->mCodecMessageQueue.push(
-                        [transcoder, index] { transcoder->enqueueInputSample(index); });
+                        {.kind = VideoTrackTranscoder::CodecEvent::INPUT_AVAILABLE,
+                         .index = index});
             }
         }
     }
@@ -131,15 +302,12 @@ struct AsyncCodecCallbackDispatch {
                                        AMediaCodecBufferInfo* bufferInfoPtr) {
         VideoTrackTranscoder::CodecWrapper* wrapper =
                 static_cast<VideoTrackTranscoder::CodecWrapper*>(userdata);
-        AMediaCodecBufferInfo bufferInfo = *bufferInfoPtr;
         if (auto transcoder = wrapper->getTranscoder()) {
-            transcoder->mCodecMessageQueue.push([transcoder, index, codec, bufferInfo] {
-                if (codec == transcoder->mDecoder) {
-                    transcoder->transferBuffer(index, bufferInfo);
-                } else if (codec == transcoder->mEncoder->getCodec()) {
-                    transcoder->dequeueOutputSample(index, bufferInfo);
-                }
-            });
+            transcoder->mCodecMessageQueue.push(
+                    {.kind = VideoTrackTranscoder::CodecEvent::OUTPUT_AVAILABLE,
+                     .index = index,
+                     .codec = codec,
+                     .bufferInfo = *bufferInfoPtr});
         }
     }
 
@@ -148,11 +316,16 @@ struct AsyncCodecCallbackDispatch {
                 static_cast<VideoTrackTranscoder::CodecWrapper*>(userdata);
         if (auto transcoder = wrapper->getTranscoder()) {
             const bool isDecoder = codec == transcoder->mDecoder;
-            const char* kCodecName = (isDecoder ? "Decoder" : "Encoder");
-            LOG(INFO) << kCodecName << " format changed: " << AMediaFormat_toString(format);
-            transcoder->mCodecMessageQueue.push([transcoder, format, isDecoder] {
-                transcoder->updateTrackFormat(format, isDecoder);
-            });
+            // AMediaFormat_toString formats every entry; only pay for it if the message is
+            // actually logged.
+            if (base::GetMinimumLogSeverity() <= base::INFO) {
+                const char* kCodecName = (isDecoder ? "Decoder" : "Encoder");
+                LOG(INFO) << kCodecName << " format changed: " << AMediaFormat_toString(format);
+            }
+            transcoder->mCodecMessageQueue.push(
+                    {.kind = VideoTrackTranscoder::CodecEvent::FORMAT_CHANGED,
+                     .format = format,
+                     .fromDecoder = isDecoder});
         }
     }
 
@@ -163,8 +336,10 @@ struct AsyncCodecCallbackDispatch {
         VideoTrackTranscoder::CodecWrapper* wrapper =
                 static_cast<VideoTrackTranscoder::CodecWrapper*>(userdata);
         if (auto transcoder = wrapper->getTranscoder()) {
-            transcoder->mCodecMessageQueue.push(
-                    [transcoder, error] { transcoder->mStatus = error; }, true);
+            // Store the error directly and wake the transcoding thread so that it notices
+            // without having to work through already queued events first.
+            transcoder->mStatus = error;
+            transcoder->mCodecMessageQueue.wake();
         }
     }
 };
@@ -173,8 +348,10 @@ struct AsyncCodecCallbackDispatch {
 std::shared_ptr<VideoTrackTranscoder> VideoTrackTranscoder::create(
         const std::weak_ptr<MediaTrackTranscoderCallback>& transcoderCallback, pid_t pid,
         uid_t uid) {
-    return std::shared_ptr<VideoTrackTranscoder>(
+    auto transcoder = std::shared_ptr<VideoTrackTranscoder>(
             new VideoTrackTranscoder(transcoderCallback, pid, uid));
+    transcoder->mSamplePool = std::make_shared<SamplePool>();
+    return transcoder;
 }
 
 VideoTrackTranscoder::~VideoTrackTranscoder() {
@@ -260,7 +437,7 @@ media_status_t VideoTrackTranscoder::configureDestinationFormat(
     SetDefaultFormatValueInt32(TBD_AMEDIACODEC_PARAMETER_KEY_BACKGROUND_MODE, encoderFormat,
                                1 /* true */);
 
-    mDestinationFormat = std::shared_ptr<AMediaFormat>(encoderFormat, &AMediaFormat_delete);
+    mDestinationFormat.reset(encoderFormat);
 
     // Create and configure the encoder.
     const char* destinationMime = nullptr;
@@ -284,8 +461,12 @@ media_status_t VideoTrackTranscoder::configureDestinationFormat(
         return AMEDIA_ERROR_UNSUPPORTED;
     }
     mEncoder = std::make_shared<CodecWrapper>(encoder, shared_from_this());
+    mSamplePool->setEncoder(mEncoder);
 
-    LOG(INFO) << "Configuring encoder with: " << AMediaFormat_toString(mDestinationFormat.get());
+    if (base::GetMinimumLogSeverity() <= base::INFO) {
+        LOG(INFO) << "Configuring encoder with: "
+                  << AMediaFormat_toString(mDestinationFormat.get());
+    }
     status = AMediaCodec_configure(mEncoder->getCodec(), mDestinationFormat.get(),
                                    NULL /* surface */, NULL /* crypto */,
                                    AMEDIACODEC_CONFIGURE_FLAG_ENCODE);
@@ -318,12 +499,11 @@ media_status_t VideoTrackTranscoder::configureDestinationFormat(
         return AMEDIA_ERROR_UNSUPPORTED;
     }
 
-    auto decoderFormat = std::shared_ptr<AMediaFormat>(AMediaFormat_new(), &AMediaFormat_delete);
-    if (!decoderFormat ||
-        AMediaFormat_copy(decoderFormat.get(), mSourceFormat.get()) != AMEDIA_OK) {
-        LOG(ERROR) << "Unable to copy source format";
-        return AMEDIA_ERROR_INVALID_PARAMETER;
-    }
+    // Configure the decoder with the source format directly rather than with a deep copy of it.
+    // The decoder-only keys set below are harmless to leave on the source format: this track
+    // transcoder is the format's sole owner and only reads container-level keys from it, none of
+    // which are touched here.
+    std::shared_ptr<AMediaFormat> decoderFormat = mSourceFormat;
 
     // Request decoder to convert HDR content to SDR.
     const bool sourceIsHdr = VideoIsHdr(mSourceFormat.get());
@@ -337,14 +517,17 @@ media_status_t VideoTrackTranscoder::configureDestinationFormat(
     AMediaFormat_setInt32(decoderFormat.get(), TBD_AMEDIACODEC_PARAMETER_KEY_ALLOW_FRAME_DROP, 0);
 
     // Copy over configurations that apply to both encoder and decoder.
-    static const std::vector<EntryCopier> kEncoderEntriesToCopy{
+    static const EntryCopier kEncoderEntriesToCopy[] = {
             ENTRY_COPIER2(AMEDIAFORMAT_KEY_OPERATING_RATE, Float, Int32),
             ENTRY_COPIER(AMEDIAFORMAT_KEY_PRIORITY, Int32),
             ENTRY_COPIER(TBD_AMEDIACODEC_PARAMETER_KEY_BACKGROUND_MODE, Int32),
     };
-    CopyFormatEntries(mDestinationFormat.get(), decoderFormat.get(), kEncoderEntriesToCopy);
+    CopyFormatEntries(mDestinationFormat.get(), decoderFormat.get(), kEncoderEntriesToCopy,
+                      std::size(kEncoderEntriesToCopy));
 
-    LOG(INFO) << "Configuring decoder with: " << AMediaFormat_toString(decoderFormat.get());
+    if (base::GetMinimumLogSeverity() <= base::INFO) {
+        LOG(INFO) << "Configuring decoder with: " << AMediaFormat_toString(decoderFormat.get());
+    }
     status = AMediaCodec_configure(mDecoder, decoderFormat.get(), mSurface, NULL /* crypto */,
                                    0 /* flags */);
     if (status != AMEDIA_OK) {
@@ -394,9 +577,59 @@ media_status_t VideoTrackTranscoder::configureDestinationFormat(
         return status;
     }
 
+    // Cache the source track settings carried over to the muxer track format. Absent keys leave
+    // the values at 0, which updateTrackFormat treats as "not specified".
+    AMediaFormat* srcFormat = mSourceFormat.get();
+    AMediaFormat_getInt32(srcFormat, AMEDIAFORMAT_KEY_SAR_WIDTH, &mSourceOverrides.sarWidth);
+    AMediaFormat_getInt32(srcFormat, AMEDIAFORMAT_KEY_SAR_HEIGHT, &mSourceOverrides.sarHeight);
+    AMediaFormat_getInt32(srcFormat, AMEDIAFORMAT_KEY_DISPLAY_WIDTH,
+                          &mSourceOverrides.displayWidth);
+    AMediaFormat_getInt32(srcFormat, AMEDIAFORMAT_KEY_DISPLAY_HEIGHT,
+                          &mSourceOverrides.displayHeight);
+    AMediaFormat_getInt32(srcFormat, AMEDIAFORMAT_KEY_ROTATION, &mSourceOverrides.rotation);
+    AMediaFormat_getInt64(srcFormat, AMEDIAFORMAT_KEY_DURATION, &mSourceOverrides.durationUs);
+
     return AMEDIA_OK;
 }
 
+void VideoTrackTranscoder::processCodecEvent(const CodecEvent& event) {
+    switch (event.kind) {
+    case CodecEvent::START_CODECS:
+        startCodecs();
+        break;
+    case CodecEvent::INPUT_AVAILABLE:
+        enqueueInputSample(event.index);
+        break;
+    case CodecEvent::OUTPUT_AVAILABLE:
+        if (event.codec == mDecoder) {
+            transferBuffer(event.index, event.bufferInfo);
+        } else if (event.codec == mEncoder->getCodec()) {
+            dequeueOutputSample(event.index, event.bufferInfo);
+        }
+        break;
+    case CodecEvent::FORMAT_CHANGED:
+        updateTrackFormat(event.format, event.fromDecoder);
+        break;
+    }
+}
+
+void VideoTrackTranscoder::startCodecs() {
+    media_status_t status = AMediaCodec_start(mDecoder);
+    if (status != AMEDIA_OK) {
+        LOG(ERROR) << "Unable to start video decoder: " << status;
+        mStatus = status;
+        return;
+    }
+
+    status = AMediaCodec_start(mEncoder->getCodec());
+    if (status != AMEDIA_OK) {
+        LOG(ERROR) << "Unable to start video encoder: " << status;
+        mStatus = status;
+        return;
+    }
+    mEncoder->setStarted();
+}
+
 void VideoTrackTranscoder::enqueueInputSample(int32_t bufferIndex) {
     media_status_t status = AMEDIA_OK;
 
@@ -413,6 +646,9 @@ void VideoTrackTranscoder::enqueueInputSample(int32_t bufferIndex) {
     const bool endOfStream = (status == AMEDIA_ERROR_END_OF_STREAM);
 
     if (!endOfStream) {
+        // The buffer pointer has to be fetched on each dequeue; the NDK only guarantees it
+        // until the buffer is queued back to the codec, so it cannot be memoized per index.
+        // The size comes back through the same call, so the check below is free.
         size_t bufferSize = 0;
         uint8_t* sourceBuffer = AMediaCodec_getInputBuffer(mDecoder, bufferIndex, &bufferSize);
         if (sourceBuffer == nullptr) {
@@ -473,14 +709,8 @@ void VideoTrackTranscoder::dequeueOutputSample(int32_t bufferIndex,
         uint8_t* buffer =
                 AMediaCodec_getOutputBuffer(mEncoder->getCodec(), bufferIndex, &sampleSize);
 
-        MediaSample::OnSampleReleasedCallback bufferReleaseCallback =
-                [encoder = mEncoder](MediaSample* sample) {
-                    AMediaCodec_releaseOutputBuffer(encoder->getCodec(), sample->bufferId,
-                                                    false /* render */);
-                };
-
-        std::shared_ptr<MediaSample> sample = MediaSample::createWithReleaseCallback(
-                buffer, bufferInfo.offset, bufferIndex, bufferReleaseCallback);
+        std::shared_ptr<MediaSample> sample =
+                mSamplePool->acquireSample(buffer, bufferInfo.offset, bufferIndex);
         sample->info.size = bufferInfo.size;
         sample->info.flags = bufferInfo.flags;
         sample->info.presentationTimeUs = bufferInfo.presentationTimeUs;
@@ -510,14 +740,15 @@ void VideoTrackTranscoder::dequeueOutputSample(int32_t bufferIndex,
 
 void VideoTrackTranscoder::updateTrackFormat(AMediaFormat* outputFormat, bool fromDecoder) {
     if (fromDecoder) {
-        static const std::vector<AMediaFormatUtils::EntryCopier> kValuesToCopy{
+        static const AMediaFormatUtils::EntryCopier kValuesToCopy[] = {
                 ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_RANGE, Int32),
                 ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_STANDARD, Int32),
                 ENTRY_COPIER(AMEDIAFORMAT_KEY_COLOR_TRANSFER, Int32),
         };
         AMediaFormat* params = AMediaFormat_new();
         if (params != nullptr) {
-            AMediaFormatUtils::CopyFormatEntries(outputFormat, params, kValuesToCopy);
+            AMediaFormatUtils::CopyFormatEntries(outputFormat, params, kValuesToCopy,
+                                                 std::size(kValuesToCopy));
             if (AMediaCodec_setParameters(mEncoder->getCodec(), params) != AMEDIA_OK) {
                 LOG(WARNING) << "Unable to update encoder with color information";
             }
@@ -544,27 +775,26 @@ void VideoTrackTranscoder::updateTrackFormat(AMediaFormat* outputFormat, bool fr
     // Transfer necessary fields from the user-configured track format (derived from
     // source track format and user transcoding request) where needed.
 
-    // Transfer SAR settings:
-    // If mDestinationFormat has SAR set, it means the original source has SAR specified
-    // at container level. This is supposed to override any SAR settings in the bitstream,
-    // thus should always be transferred to the container of the transcoded file.
-    int32_t sarWidth, sarHeight;
-    if (AMediaFormat_getInt32(mSourceFormat.get(), AMEDIAFORMAT_KEY_SAR_WIDTH, &sarWidth) &&
-        (sarWidth > 0) &&
-        AMediaFormat_getInt32(mSourceFormat.get(), AMEDIAFORMAT_KEY_SAR_HEIGHT, &sarHeight) &&
-        (sarHeight > 0)) {
-        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_SAR_WIDTH, sarWidth);
-        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_SAR_HEIGHT, sarHeight);
-    }
-    // Transfer DAR settings.
-    int32_t displayWidth, displayHeight;
-    if (AMediaFormat_getInt32(mSourceFormat.get(), AMEDIAFORMAT_KEY_DISPLAY_WIDTH, &displayWidth) &&
-        (displayWidth > 0) &&
-        AMediaFormat_getInt32(mSourceFormat.get(), AMEDIAFORMAT_KEY_DISPLAY_HEIGHT,
-                              &displayHeight) &&
-        (displayHeight > 0)) {
-        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_DISPLAY_WIDTH, displayWidth);
-        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_DISPLAY_HEIGHT, displayHeight);
+    // Transfer SAR and DAR settings:
+    // If the source has SAR set, it means the original source has SAR specified at container
+    // level. This is supposed to override any SAR settings in the bitstream, thus should always
+    // be transferred to the container of the transcoded file. Same applies to DAR.
+    const struct {
+        const char* widthKey;
+        const char* heightKey;
+        int32_t width;
+        int32_t height;
+    } kAspectRatios[] = {
+            {AMEDIAFORMAT_KEY_SAR_WIDTH, AMEDIAFORMAT_KEY_SAR_HEIGHT, mSourceOverrides.sarWidth,
+             mSourceOverrides.sarHeight},
+            {AMEDIAFORMAT_KEY_DISPLAY_WIDTH, AMEDIAFORMAT_KEY_DISPLAY_HEIGHT,
+             mSourceOverrides.displayWidth, mSourceOverrides.displayHeight},
+    };
+    for (const auto& aspectRatio : kAspectRatios) {
+        if (aspectRatio.width > 0 && aspectRatio.height > 0) {
+            AMediaFormat_setInt32(formatCopy, aspectRatio.widthKey, aspectRatio.width);
+            AMediaFormat_setInt32(formatCopy, aspectRatio.heightKey, aspectRatio.height);
+        }
     }
 
     // Transfer rotation settings.
@@ -572,24 +802,22 @@ void VideoTrackTranscoder::updateTrackFormat(AMediaFormat* outputFormat, bool fr
     // AMediaMuxer_setOrientationHint to set the rotation. Here we pass the rotation to
     // MediaSampleWriter using the track format. MediaSampleWriter will then call
     // AMediaMuxer_setOrientationHint as needed.
-    int32_t rotation;
-    if (AMediaFormat_getInt32(mSourceFormat.get(), AMEDIAFORMAT_KEY_ROTATION, &rotation) &&
-        (rotation != 0)) {
-        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_ROTATION, rotation);
+    if (mSourceOverrides.rotation != 0) {
+        AMediaFormat_setInt32(formatCopy, AMEDIAFORMAT_KEY_ROTATION, mSourceOverrides.rotation);
     }
 
     // Transfer track duration.
     // Preserve the source track duration by sending it to MediaSampleWriter.
-    int64_t durationUs;
-    if (AMediaFormat_getInt64(mSourceFormat.get(), AMEDIAFORMAT_KEY_DURATION, &durationUs) &&
-        durationUs > 0) {
-        AMediaFormat_setInt64(formatCopy, AMEDIAFORMAT_KEY_DURATION, durationUs);
+    if (mSourceOverrides.durationUs > 0) {
+        AMediaFormat_setInt64(formatCopy, AMEDIAFORMAT_KEY_DURATION, mSourceOverrides.durationUs);
     }
 
     // TODO: transfer other fields as required.
 
     mActualOutputFormat = std::shared_ptr<AMediaFormat>(formatCopy, &AMediaFormat_delete);
-    LOG(INFO) << "Actual output format: " << AMediaFormat_toString(formatCopy);
+    if (base::GetMinimumLogSeverity() <= base::INFO) {
+        LOG(INFO) << "Actual output format: " << AMediaFormat_toString(formatCopy);
+    }
 
     notifyTrackFormatAvailable();
 }
@@ -597,30 +825,25 @@ void VideoTrackTranscoder::updateTrackFormat(AMediaFormat* outputFormat, bool fr
 media_status_t VideoTrackTranscoder::runTranscodeLoop(bool* stopped) {
     prctl(PR_SET_NAME, (unsigned long)"VideTranscodTrd", 0, 0, 0);
 
-    // Push start decoder and encoder as two messages, so that these are subject to the
-    // stop request as well. If the session is cancelled (or paused) immediately after start,
-    // we don't need to waste time start then stop the codecs.
-    mCodecMessageQueue.push([this] {
-        media_status_t status = AMediaCodec_start(mDecoder);
-        if (status != AMEDIA_OK) {
-            LOG(ERROR) << "Unable to start video decoder: " << status;
-            mStatus = status;
-        }
-    });
-
-    mCodecMessageQueue.push([this] {
-        media_status_t status = AMediaCodec_start(mEncoder->getCodec());
-        if (status != AMEDIA_OK) {
-            LOG(ERROR) << "Unable to start video encoder: " << status;
-            mStatus = status;
-        }
-        mEncoder->setStarted();
-    });
+    // Push codec start as an event, so that it is subject to the stop request as well. If the
+    // session is cancelled (or paused) immediately after start, we don't need to waste time
+    // start then stop the codecs.
+    mCodecMessageQueue.push({.kind = CodecEvent::START_CODECS});
 
     // Process codec events until EOS is reached, transcoding is stopped or an error occurs.
+    // Events are drained from the queue in batches so that the queue lock is taken once per
+    // wakeup rather than once per event; the stop conditions are still checked between events.
+    std::vector<CodecEvent> events;
+    size_t nextEvent = 0;
     while (mStopRequest != STOP_NOW && !mEosFromEncoder && mStatus == AMEDIA_OK) {
-        std::function<void()> message = mCodecMessageQueue.pop();
-        message();
+        if (nextEvent == events.size()) {
+            events.clear();
+            nextEvent = 0;
+            mCodecMessageQueue.drain(&events);
+            // A wake may deliver no events; re-check the stop conditions before dispatching.
+            continue;
+        }
+        processCodecEvent(events[nextEvent++]);
 
         if (mStopRequest == STOP_ON_SYNC && mLastSampleWasSync) {
             break;
@@ -640,8 +863,8 @@ media_status_t VideoTrackTranscoder::runTranscodeLoop(bool* stopped) {
 
 void VideoTrackTranscoder::abortTranscodeLoop() {
     if (mStopRequest == STOP_NOW) {
-        // Wake up transcoder thread.
-        mCodecMessageQueue.push([] {}, true /* front */);
+        // Wake up transcoder thread so that it re-checks the stop request.
+        mCodecMessageQueue.wake();
     }
 }
 
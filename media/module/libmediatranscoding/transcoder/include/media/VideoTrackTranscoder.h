@@ -22,9 +22,11 @@
 #include <media/NdkMediaCodecPlatform.h>
 #include <media/NdkMediaFormat.h>
 
+#include <atomic>
 #include <condition_variable>
-#include <deque>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace android {
 
@@ -51,17 +53,63 @@ private:
     template <typename T>
     class BlockingQueue {
     public:
-        void push(T const& value, bool front = false);
-        T pop();
+        // Sized for the sum of the decoder's and encoder's buffer counts so the ring never
+        // grows in steady state (each buffer index has at most one event queued at a time).
+        static constexpr size_t kInitialCapacity = 64;
+
+        BlockingQueue() : mSlots(kInitialCapacity) {}
+
+        void push(T&& value);
+        // Blocks until the queue is non-empty or wake() is called, then moves
+        // all queued elements into |out| under a single lock acquisition.
+        void drain(std::vector<T>* out);
+        // Wakes the consumer if it is blocked in drain, making drain return
+        // even if the queue is empty so the consumer can re-check its
+        // termination conditions.
+        void wake();
+        // Drops all queued elements, makes subsequent pushes no-ops, and wakes the consumer if
+        // it is blocked in drain. Safe to call from any thread.
         void abort();
 
     private:
+        // Grows the ring to twice its current capacity.
+        void grow();
+
         std::mutex mMutex;
         std::condition_variable mCondition;
-        std::deque<T> mQueue;
+        // Circular buffer; mHead indexes the oldest queued element. Slots are
+        // reused across push/pop cycles so steady-state pushes do not allocate.
+        std::vector<T> mSlots;
+        size_t mHead = 0;
+        size_t mCount = 0;
+        bool mWakeup = false;
         bool mAborted = false;
+        // True while the consumer is blocked in drain; producers skip the condition variable
+        // notify when this is false since the consumer will see the new element on its own.
+        bool mConsumerWaiting = false;
     };
     class CodecWrapper;
+    class SamplePool;
+
+    // A codec callback event queued for the transcoding thread. Events are plain data stored
+    // inline in the queue slots and dispatched on |kind| in processCodecEvent, so queueing an
+    // event is a struct copy with no type erasure or heap allocation, which the previous
+    // std::function-based messages needed for payloads past the small-object threshold.
+    struct CodecEvent {
+        enum Kind {
+            START_CODECS,
+            INPUT_AVAILABLE,
+            OUTPUT_AVAILABLE,
+            FORMAT_CHANGED,
+        };
+
+        Kind kind = START_CODECS;
+        int32_t index = 0;                      // INPUT_AVAILABLE, OUTPUT_AVAILABLE.
+        AMediaCodec* codec = nullptr;           // OUTPUT_AVAILABLE: the originating codec.
+        AMediaCodecBufferInfo bufferInfo = {};  // OUTPUT_AVAILABLE.
+        AMediaFormat* format = nullptr;         // FORMAT_CHANGED.
+        bool fromDecoder = false;               // FORMAT_CHANGED.
+    };
 
     VideoTrackTranscoder(const std::weak_ptr<MediaTrackTranscoderCallback>& transcoderCallback,
                          pid_t pid, uid_t uid)
@@ -75,6 +123,12 @@ private:
     std::shared_ptr<AMediaFormat> getOutputFormat() const override;
     // ~MediaTrackTranscoder
 
+    // Executes a single codec event on the transcoding thread.
+    void processCodecEvent(const CodecEvent& event);
+
+    // Starts the decoder and the encoder. Called on the transcoding thread.
+    void startCodecs();
+
     // Enqueues an input sample with the decoder.
     void enqueueInputSample(int32_t bufferIndex);
 
@@ -87,17 +141,45 @@ private:
     // Updates the video track's actual format based on encoder and decoder output format.
     void updateTrackFormat(AMediaFormat* outputFormat, bool fromDecoder);
 
+    // Source track settings that updateTrackFormat transfers to the muxer track format, read
+    // from the source format once at configure time so that format-change events don't have to
+    // re-query the format. A value of 0 means the source doesn't specify the setting.
+    struct SourceOverrides {
+        int32_t sarWidth = 0;
+        int32_t sarHeight = 0;
+        int32_t displayWidth = 0;
+        int32_t displayHeight = 0;
+        int32_t rotation = 0;
+        int64_t durationUs = 0;
+    };
+
     AMediaCodec* mDecoder = nullptr;
     std::shared_ptr<CodecWrapper> mEncoder;
+    // Recycles output MediaSample objects. Shared with the sample release path since samples,
+    // like the encoder, may outlive the transcoder.
+    std::shared_ptr<SamplePool> mSamplePool;
     ANativeWindow* mSurface = nullptr;
     bool mEosFromSource = false;
     bool mEosFromEncoder = false;
     bool mLastSampleWasSync = false;
-    media_status_t mStatus = AMEDIA_OK;
+    // Atomic since the codec error callback stores the failure directly, off the transcoding
+    // thread, instead of going through the message queue.
+    std::atomic<media_status_t> mStatus = AMEDIA_OK;
     MediaSampleInfo mSampleInfo;
-    BlockingQueue<std::function<void()>> mCodecMessageQueue;
-    std::shared_ptr<AMediaFormat> mDestinationFormat;
+    // Cache-line aligned so that the queue state, which the codec callback threads write on
+    // every event, doesn't share a line with the transcoding thread's loop state above.
+    // The queue's depth is naturally bounded without an explicit cap: each codec buffer index
+    // has at most one outstanding event until it is processed and the buffer released, so a
+    // slow downstream consumer stalls the codecs through buffer exhaustion instead of growing
+    // the queue.
+    alignas(64) BlockingQueue<CodecEvent> mCodecMessageQueue;
+    // Only accessed from the transcoding thread, so sole ownership is enough and there is no
+    // need for a shared_ptr control block. mActualOutputFormat stays shared since it is handed
+    // out through getOutputFormat.
+    std::unique_ptr<AMediaFormat, decltype(&AMediaFormat_delete)> mDestinationFormat{
+            nullptr, &AMediaFormat_delete};
     std::shared_ptr<AMediaFormat> mActualOutputFormat;
+    SourceOverrides mSourceOverrides;
     pid_t mPid;
     uid_t mUid;
     uint64_t mInputFrameCount = 0;